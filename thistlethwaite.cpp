@@ -17,9 +17,34 @@
 #include <time.h> // random
 #include <queue>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <list>
 #include <ctime>
 #include <fstream>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <string.h> // memset
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h> // solve server
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/mman.h> // search tables
+#include <sched.h> // NUMA
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 
 using namespace std;
@@ -32,8 +57,57 @@ using namespace std;
 //({0,1,2,3,4,5,6,7,...,19},{0,0,0,0,0,0,0,0,0,0,0,0},{0,0,0,0,0,0,0,0}
 
 typedef vector<int> vi;
-int phase = 0; // class variable for current phase of algorithm
-int totalMoves = 0; // class variable for tracking iterations of our BFS
+typedef unsigned long long ull;
+// Per thread so that several cubes can be solved at once
+thread_local int phase = 0; // class variable for current phase of algorithm
+thread_local int totalMoves = 0; // class variable for tracking iterations of our BFS
+
+// Value of phase while phases 2 and 3 are searched as one, see solve()
+const int FUSED_PHASE = 5;
+
+//--- Limits for a single solve, see solve() and solveAsync()
+// UNSOLVABLE - the search ran out of cubes to try without reaching the goal
+enum solveStatus { SOLVED, CANCELLED, DEADLINE_EXCEEDED, NODE_BUDGET_EXCEEDED,
+   UNSOLVABLE };
+
+// Shared with the caller, set to true to abandon a running solve
+typedef shared_ptr< atomic<bool> > cancelToken;
+
+struct solveBudget {
+   chrono::steady_clock::time_point deadline; // default constructed = none
+   long long nodeBudget; // expanded nodes allowed, 0 = unlimited
+   cancelToken cancel; // may be empty
+   long long fusedBudget; // nodes for a fused phase 2+3 search, 0 = off
+   int beamWidth; // solutions kept per phase, see solveBeam(), 1 = off
+   size_t memoryLimit; // bytes a phase's search table may grow to, 0 = unlimited
+   // positive cost of each move 0-17 for weightedSearch(), empty = fewest
+   // moves; not used by the beam
+   vector<double> moveCost;
+   long long nodes; // expanded so far, updated by the search
+   size_t peakMemory; // largest search memory held, updated by the search
+   int status; // solveStatus, updated by the search
+
+   solveBudget() : nodeBudget(0), fusedBudget(0), beamWidth(1),
+	  memoryLimit(0), nodes(0), peakMemory(0), status(SOLVED) {}
+};
+
+// Budgets are only checked once every this many expansions
+const int BUDGET_CHECK_INTERVAL = 1024;
+
+// Returns true, and records why, once a budget has run out
+bool budgetExhausted(solveBudget * budget){
+   if( budget->cancel && budget->cancel->load(memory_order_relaxed) ){
+	  budget->status = CANCELLED;
+   }
+   else if( budget->nodeBudget > 0 && budget->nodes >= budget->nodeBudget ){
+	  budget->status = NODE_BUDGET_EXCEEDED;
+   }
+   else if( budget->deadline != chrono::steady_clock::time_point() &&
+		 chrono::steady_clock::now() >= budget->deadline ){
+	  budget->status = DEADLINE_EXCEEDED;
+   }
+   return budget->status != SOLVED;
+}
 
 //--- Edge identifiers
 int UF = 0;
@@ -216,6 +290,123 @@ vi id(vi state){
 }
 
 
+//--- Lehmer rank of a permutation of 0..n-1, used to squeeze a full
+//permutation into a handful of bits.
+ull permRank(const int * perm, int n){
+   ull rank = 0;
+   for( int i = 0; i < n; i++ ){
+	  int smaller = 0;
+	  for( int j = i+1; j < n; j++ ){
+		 if( perm[j] < perm[i] ){
+			smaller++;
+		 }
+	  }
+	  rank = rank * (n-i) + smaller;
+   }
+   return rank;
+}
+
+//--- Inverse of permRank(), writes the permutation of 0..n-1 with this rank.
+//The digits count the inversions, so their sum gives the parity for free:
+//returns 1 for an odd permutation.
+int permUnrank(ull rank, int * perm, int n){
+   int digits[12];
+   int parity = 0;
+   for( int i = n-1; i >= 0; i-- ){
+	  digits[i] = rank % (n-i);
+	  rank /= (n-i);
+	  parity ^= digits[i] & 1;
+   }
+   bool used[12] = { false };
+   for( int i = 0; i < n; i++ ){
+	  int skip = digits[i];
+	  for( int j = 0; j < n; j++ ){
+		 if( !used[j] && skip-- == 0 ){
+			perm[i] = j;
+			used[j] = true;
+			break;
+		 }
+	  }
+   }
+   return parity;
+}
+
+//--- Pack the phase ID of a state into a single 64 bit key. Two states share
+//a key exactly when id() returns the same vector for both, so the key can be
+//used in place of the ID for the search tables.
+ull compactID(const vi & state){
+
+   //--- Fused phases 2 and 3: the phase 3 key, plus the M-slice mask and the
+   //corner orientations (base 3, the last one is implied) from phase 2. The
+   //phase 2 corner mask is left out, the phase 3 pair labels cover it.
+   if( phase == FUSED_PHASE ){
+	  phase = 2;
+	  ull g2 = compactID(state);
+	  phase = 3;
+	  ull g3 = compactID(state);
+	  phase = FUSED_PHASE;
+	  ull twist = 0;
+	  for( int i = 6; i >= 0; i-- ){
+		 twist = twist * 3 + ( ( g2 >> (2*i) ) & 3 );
+	  }
+	  return g3 | ( ( g2 >> 24 ) << 33 ) | ( twist << 45 );
+   }
+
+   vi pid = id(state);
+
+   //--- Phase 1: 12 edge orientation bits
+   if( phase == 1 ){
+	  ull key = 0;
+	  for( int i = 0; i < 12; i++ ){
+		 key |= (ull)pid[i] << i;
+	  }
+	  return key;
+   }
+
+   //--- Phase 2: corner orientations, then position masks of the tracked
+   //corners and M-slice edges (the ID lists these positions in order)
+   if( phase == 2 ){
+	  ull key = 0;
+	  for( int i = 0; i < 8; i++ ){
+		 key |= (ull)pid[i] << (2*i);
+	  }
+	  for( int i = 8; i < 12; i++ ){
+		 key |= 1ULL << (16 + pid[i] - 12);
+	  }
+	  for( int i = 12; i < 16; i++ ){
+		 key |= 1ULL << (24 + pid[i]);
+	  }
+	  return key;
+   }
+
+   //--- Phase 3: E-slice position mask, a 2 bit pair label for each corner
+   //location and the tetrad parity count (31 when it was left out)
+   if( phase == 3 ){
+	  ull key = 0;
+	  for( int i = 0; i < 4; i++ ){
+		 key |= 1ULL << pid[i];
+	  }
+	  // pairs (UFR,UBL), (DBR,DFL), (UBR,UFL), (DFR,DBL)
+	  int pairStart[4] = { 8, 10, 16, 18 };
+	  for( int p = 0; p < 4; p++ ){
+		 for( int i = pairStart[p]; i < pairStart[p] + 2; i++ ){
+			key |= (ull)p << (12 + 2*(pid[i] - 12));
+		 }
+	  }
+	  ull tetrad = ( pid.size() > 20 ) ? pid[20] : 31;
+	  return key | ( tetrad << 28 );
+   }
+
+   //--- Phase 4: the whole state. Orientations are always zero in G3, so
+   //ranking both permutations is enough.
+   int corners[8];
+   for( int i = 0; i < 8; i++ ){
+	  corners[i] = state[i+12] - 12;
+   }
+   return permRank(&state[0], 12) * 40320 + permRank(corners, 8);
+}
+
+
 //--- Update an input state after applying a move
 //--- Input: int move - a number between 0-17, signifying one of the eighteen
 //possible cube operations (R, R2, R3, L, L2, L3, ... etc).
@@ -759,7 +950,8 @@ vector<vi> applicableMoves{
 	  {0,1,2,3,4,5}, // moves to transition to g1 // phase 1
 	  {0,1,8,9,4,5}, // moves to transition to g2 // phase 2
 	  {0,1,8,9,10,11}, // moves to transition to g3 // phase 3
-	  {6,7,8,9,10,11} // moves to transition to g4 // phase 4
+	  {6,7,8,9,10,11}, // moves to transition to g4 // phase 4
+	  {0,1,8,9,4,5} // g1 straight to g3 // FUSED_PHASE
 };
 
 // Define the integer change to result in an inverse move upon inputting
@@ -801,213 +993,2327 @@ void print_state(vi & state){
    cout << " > " << endl;
 }  
 
-// Bidirectional Breadth First Search
-vi BDBFS(vi & startState, vi goalState){
+// Initialize a cube's solved state
+vi initialize(){
+   vi state{UF,UR, UB, UL, FR, FL, BR, BL, DF, DR, DB, DL, UFR, UBR, UBL,
+	  UFL, DFR, DBR, DBL, DFL};
+   for(int i = 0; i < 20; i++){
+	  state.push_back(0);
+   }
+   return state;
+}
 
-   // compute start state ID, goal state ID
-   vi startID = id(startState);
-   vi goalID = id(goalState);
 
-   // initialize queues for forward and backward search
-   // queue of states
-   queue<vi> q;
-   q.push(startState);
-   q.push(goalState);
+//--- NUMA support
+// Node the calling worker is pinned to, 0 when not pinned
+thread_local int numaNode = 0;
+
+// Numbers in a list of ranges like "0-3,8-11", as sysfs and /proc write them
+vi parseRangeList(const string & list){
+   vi numbers;
+   istringstream ranges(list);
+   string range;
+   while( getline(ranges, range, ',') ){
+	  int first, last;
+	  if( sscanf(range.c_str(), "%d-%d", &first, &last) != 2 ){
+		 if( sscanf(range.c_str(), "%d", &first) != 1 ){
+			continue;
+		 }
+		 last = first;
+	  }
+	  for( int n = first; n <= last; n++ ){
+		 numbers.push_back(n);
+	  }
+   }
+   return numbers;
+}
 
-   // initialize tables for BFS
-   map<vi, int> direction;
-   map<vi, int> lastMove;
-   map<vi, vi> predecessor;
+// The first line of a file as a list of ranges
+vi readRangeList(const string & path){
+   ifstream in(path.c_str());
+   string list;
+   if( !getline(in, list) ){
+	  return vi();
+   }
+   return parseRangeList(list);
+}
 
-   // initialize directions for starting states
-   direction[startID] = 1;
-   direction[goalID] = 2;
+// Where the process was allowed to run when it started, e.g. by taskset,
+// numactl or a cpuset. Read once, from the thread that first asks, before
+// any worker pins itself.
+struct numaLimits {
+   vector<bool> cpus; // cpus in the process affinity mask
+   vector<bool> mems; // nodes the process may allocate memory from
+   bool ownPolicy; // started with a memory policy (numactl --membind,
+				   // --interleave, ...) that pinning must not replace
+};
 
-   // Already in phase, return
-   if( startID == goalID ){
-	  vi retPath;
-	  return retPath;
+numaLimits readNumaLimits(){
+   numaLimits limits;
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   limits.cpus.assign(CPU_SETSIZE, true);
+   if( sched_getaffinity(getpid(), sizeof(set), &set) == 0 ){
+	  for( int cpu = 0; cpu < CPU_SETSIZE; cpu++ ){
+		 limits.cpus[cpu] = CPU_ISSET(cpu, &set);
+	  }
    }
 
-   // begin BFS for particular phase
-   while(!q.empty()){
-
-	  // get information from queue
-	  vi oldState = q.front();
-	  q.pop();
-	  vi oldID = id(oldState);
-	  int& oldDir = direction[oldID];
+   // the cpuset's memory nodes
+   limits.mems.assign(1024, true);
+   ifstream status("/proc/self/status");
+   string line;
+   while( getline(status, line) ){
+	  if( line.compare(0, 18, "Mems_allowed_list:") == 0 ){
+		 vi allowed = parseRangeList(line.substr(18));
+		 limits.mems.assign(1024, false);
+		 for( int i = 0; i < allowed.size(); i++ ){
+			if( allowed[i] < 1024 ){
+			   limits.mems[ allowed[i] ] = true;
+			}
+		 }
+	  }
+   }
 
-	  // Get appropriate moveset for group
-	  vi moveSet = applicableMoves[phase];
-	  for( int i = 0; i < moveSet.size(); i++ ){
-		 int move = moveSet[i];
-		 totalMoves++; // helpful data gathering
+   // a bind or interleave policy narrows them further
+   int mode = MPOL_DEFAULT;
+   unsigned long mask[1024 / ( 8 * sizeof(unsigned long) )];
+   limits.ownPolicy = false;
+   if( syscall(SYS_get_mempolicy, &mode, mask, 1024, NULL, 0) == 0 ){
+	  mode &= ~MPOL_MODE_FLAGS;
+	  limits.ownPolicy = ( mode != MPOL_DEFAULT );
+	  if( mode == MPOL_BIND || mode == MPOL_INTERLEAVE ){
+		 for( int node = 0; node < 1024; node++ ){
+			int bits = 8 * sizeof(unsigned long);
+			if( !( ( mask[node / bits] >> ( node % bits ) ) & 1 ) ){
+			   limits.mems[node] = false;
+			}
+		 }
+	  }
+   }
+   return limits;
+}
 
-		 vi newState = applyMove(move, oldState);
-		 vi newID = id(newState);
-		 int& newDir = direction[newID];
+const numaLimits & processNumaLimits(){
+   static const numaLimits limits = readNumaLimits();
+   return limits;
+}
 
-		 //--- newDir == 0 if it is a new direction
-		 //--- newDir == 1 if we have seen this from the forward search
-		 //--- newDir == 2 if if we have seen this from the backward search
-		 //--- if newDir > 0, and newDir != oldDir, then we have found a
-		 //connecting path from forward and backward search
+// Cpus of every memory node the process may use, read from sysfs and
+// indexed by node id, the id set_mempolicy() takes. Only cpus in the
+// process affinity mask are listed, and nodes outside its allowed memory
+// nodes get none. Node ids can have gaps and nodes can be memory only, both
+// are left as empty entries. Without NUMA information every allowed cpu is
+// reported on the first allowed node.
+vector<vi> numaTopology(){
+   const numaLimits & limits = processNumaLimits();
+   vector<vi> nodes;
+   vi online = readRangeList("/sys/devices/system/node/online");
+   bool anyCpus = false;
+   for( int i = 0; i < online.size(); i++ ){
+	  int node = online[i];
+	  if( node >= nodes.size() ){
+		 nodes.resize(node + 1);
+	  }
+	  if( node >= limits.mems.size() || !limits.mems[node] ){
+		 continue;
+	  }
+	  ostringstream name;
+	  name << "/sys/devices/system/node/node" << node << "/cpulist";
+	  vi cpus = readRangeList(name.str());
+	  for( int j = 0; j < cpus.size(); j++ ){
+		 if( cpus[j] < limits.cpus.size() && limits.cpus[ cpus[j] ] ){
+			nodes[node].push_back(cpus[j]);
+		 }
+	  }
+	  anyCpus = anyCpus || !nodes[node].empty();
+   }
+   if( !anyCpus ){
+	  int first = 0;
+	  while( first + 1 < limits.mems.size() && !limits.mems[first] ){
+		 first++;
+	  }
+	  nodes.assign(first + 1, vi());
+	  for( int cpu = 0; cpu < limits.cpus.size(); cpu++ ){
+		 if( limits.cpus[cpu] ){
+			nodes[first].push_back(cpu);
+		 }
+	  }
+	  if( nodes[first].empty() ){
+		 nodes[first].push_back(0);
+	  }
+   }
+   return nodes;
+}
 
-		 if( (newDir > 0) && (newDir != oldDir) ){
+// Ids of the nodes in a numaTopology() that have cpus
+vi cpuNodes(const vector<vi> & nodes){
+   vi ids;
+   for( int node = 0; node < nodes.size(); node++ ){
+	  if( !nodes[node].empty() ){
+		 ids.push_back(node);
+	  }
+   }
+   return ids;
+}
 
-			// if newDir is 1, we are coming from backwards search
-			if( newDir == 1 ){
+// Free memory on a node in bytes, or 0 if unknown
+ull numaFreeMemory(int node){
+   ostringstream name;
+   name << "/sys/devices/system/node/node" << node << "/meminfo";
+   ifstream in(name.str().c_str());
+   string line;
+   while( getline(in, line) ){
+	  ull kb;
+	  if( line.find("MemFree:") != string::npos &&
+			sscanf(line.substr(line.find(':') + 1).c_str(), "%llu", &kb) == 1 ){
+		 return kb * 1024;
+	  }
+   }
+   return 0;
+}
 
-			   vi path;
-			   // rebuild path from newID -> startID
-			   while( newID != startID ){
-				  path.insert(path.begin(), lastMove[newID]);
-				  newID = predecessor[newID];
-			   }
+// Pin the calling thread to one cpu and prefer memory from its node. With
+// MPOL_PREFERRED the kernel still takes pages elsewhere once the node is
+// full, so a busy node slows down rather than failing. A memory policy the
+// process was started with is left in place. Returns false, leaving
+// numaNode alone, if the thread could not be placed.
+bool pinToCpu(int cpu, int node){
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   if( sched_setaffinity(0, sizeof(set), &set) != 0 ){
+	  return false;
+   }
 
-			   // Applying connecting move
-			   path.push_back(inverse(move));
+   if( !processNumaLimits().ownPolicy ){
+	  unsigned long mask = 1UL << node;
+	  if( syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+			   sizeof(mask) * 8) != 0 ){
+		 return false;
+	  }
+   }
+   numaNode = node;
+   return true;
+}
 
-			   // rebuild path from oldID -> goalID
-			   while( oldID != goalID ){
-				  path.push_back(inverse(lastMove[oldID]));
-				  oldID = predecessor[oldID];
-			   }
+//--- One copy of a read-only table per NUMA node, each built by a thread
+//pinned to that node so its pages are local. When some node has less than
+//twice the table size free, a single copy interleaved over all nodes is
+//shared instead.
+template<class T>
+class numaReplica {
+   public:
+	  numaReplica(function<T()> build, size_t bytes){
+		 vector<vi> nodes = numaTopology();
+		 vi used = cpuNodes(nodes); // workers only run on these
+		 bool tight = false;
+		 unsigned long mask = 0;
+		 for( int i = 0; i < used.size(); i++ ){
+			ull available = numaFreeMemory(used[i]);
+			if( available != 0 && available < 2 * bytes ){
+			   tight = true;
+			}
+			mask |= 1UL << used[i];
+		 }
 
-			   // Applying path to input starting state
-			   for( int i = 0; i < path.size(); i++ ){
-				  startState = applyMove(path[i], startState);
+		 if( used.size() == 1 || tight ){
+			thread builder( [&](){
+			   if( !processNumaLimits().ownPolicy ){
+				  syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, &mask,
+						sizeof(mask) * 8);
 			   }
-			   return path;
+			   copies.push_back( make_shared<T>( build() ) );
+			} );
+			builder.join();
+			return;
+		 }
 
+		 copies.resize(nodes.size());
+		 for( int i = 0; i < used.size(); i++ ){
+			int node = used[i];
+			thread builder( [&](){
+			   pinToCpu(nodes[node][0], node);
+			   copies[node] = make_shared<T>( build() );
+			} );
+			builder.join();
+		 }
+		 // nodes without cpus share the first copy, nothing runs there
+		 for( int node = 0; node < copies.size(); node++ ){
+			if( !copies[node] ){
+			   copies[node] = copies[ used[0] ];
 			}
-			// we are coming from forward search
-			if( newDir == 2 ){
+		 }
+	  }
+
+	  // The copy on the calling thread's node
+	  const T & local() const {
+		 return *copies[ numaNode < copies.size() ? numaNode : 0 ];
+	  }
 
-			   vi path;
+   private:
+	  vector< shared_ptr<T> > copies;
+};
 
-			   // rebuild path from oldID -> startID
-			   while( oldID != startID ){
-				  path.insert(path.begin(), lastMove[oldID]);
-				  oldID = predecessor[oldID];
-			   }
+//--- Move tables
+// The search carries each cube as six small coordinates instead of a state:
+// edge flips, corner twists, where the four M, E and S slice edges are, and
+// the corner permutation. A move changes every coordinate through a table
+// lookup, and the key of every phase is put together from per coordinate
+// parts. For phases 1-3 and the fused phase those parts are the bits of
+// compactID() that depend only on that coordinate, so the keys are exactly
+// the compactID() of the cube; compactID() and id() remain the reference.
+enum { EO, CO, MEDGES, EEDGES, SEDGES, CPERM, COORDS };
+
+// Bits of compactID() owned by each coordinate, by phase (index 0 and 4 unused)
+const ull keyBits[COORDS][6] = {
+   { 0, 0xfff, 0, 0, 0, 0 }, // EO
+   { 0, 0, 0xffff, 0, 0, 0xfffULL << 45 }, // CO
+   { 0, 0, 0xfffULL << 24, 0, 0, 0xfffULL << 33 }, // MEDGES
+   { 0, 0, 0, 0xfff, 0, 0xfff }, // EEDGES
+   { 0, 0, 0, 0, 0, 0 }, // SEDGES
+   { 0, 0, 0xffULL << 16, 0x1fffff000ULL, 0, 0x1fffff000ULL } // CPERM
+};
 
-			   // Applying connecting move
-			   path.push_back((move));
+// Raw values the coordinates are indexed from
+ull rawEO(const vi & state){
+   ull raw = 0;
+   for( int i = 0; i < 12; i++ ){
+	  raw |= (ull)state[i+20] << i;
+   }
+   return raw;
+}
 
-			   // rebuild path from newID -> goalID
-			   while( newID != goalID ){
-				  path.push_back(inverse(lastMove[newID]));
-				  newID = predecessor[newID];
-			   }
+ull rawCO(const vi & state){
+   ull raw = 0;
+   for( int i = 0; i < 8; i++ ){
+	  raw |= (ull)state[i+32] << (2*i);
+   }
+   return raw;
+}
 
+// Positions of four edges, 4 bits each
+ull rawEdges(const vi & state, int a, int b, int c, int d){
+   ull raw = 0;
+   for( int i = 0; i < 12; i++ ){
+	  int piece = state[i];
+	  int slot = ( piece == a ) ? 0 : ( piece == b ) ? 1 :
+		 ( piece == c ) ? 2 : ( piece == d ) ? 3 : -1;
+	  if( slot >= 0 ){
+		 raw |= (ull)i << (4*slot);
+	  }
+   }
+   return raw;
+}
 
-			   // Applying path to input starting state
-			   for( int i = 0; i < path.size(); i++ ){
-				  startState = applyMove(path[i], startState);
-			   }
-			   return path;
+ull rawM(const vi & state){ return rawEdges(state, UF, UB, DF, DB); }
+ull rawE(const vi & state){ return rawEdges(state, FR, FL, BR, BL); }
+ull rawS(const vi & state){ return rawEdges(state, UR, UL, DR, DL); }
 
-			}
-		 }
+ull rawCP(const vi & state){
+   int corners[8];
+   for( int i = 0; i < 8; i++ ){
+	  corners[i] = state[i+12] - 12;
+   }
+   return permRank(corners, 8);
+}
+
+ull (* const rawCoord[COORDS])(const vi &) = {
+   rawEO, rawCO, rawM, rawE, rawS, rawCP };
+
+// One coordinate: a transition for every move and its share of each key
+struct coordTable {
+   vector<int> next; // [index*18 + move]
+   vector<ull> key[6]; // [phase][index]
+   unordered_map<ull, int> index; // raw value -> index
+};
 
-		 // only insert into queue if we have not seen this ID
-		 if( ! newDir ){
-			q.push(newState);
-			newDir = oldDir;
-			lastMove[newID] = move;
-			predecessor[newID] = oldID;
+// Enumerate every value of a coordinate from the solved cube, keeping one
+// representative state per value to fill in the tables
+coordTable buildCoord(int which){
+   coordTable table;
+   vector<vi> reps(1, initialize());
+   table.index[ rawCoord[which](reps[0]) ] = 0;
+   for( int i = 0; i < reps.size(); i++ ){
+	  vi rep = reps[i];
+	  for( int move = 0; move < 18; move++ ){
+		 vi state = applyMove(move, rep);
+		 ull raw = rawCoord[which](state);
+		 unordered_map<ull, int>::iterator it = table.index.find(raw);
+		 if( it == table.index.end() ){
+			it = table.index.insert( make_pair(raw, (int)reps.size()) ).first;
+			reps.push_back(state);
 		 }
+		 table.next.push_back(it->second);
+	  }
+   }
+
+   int oldPhase = phase;
+   for( int p = 1; p <= FUSED_PHASE; p++ ){
+	  table.key[p].resize(reps.size(), 0);
+	  if( keyBits[which][p] == 0 ){
+		 continue;
+	  }
+	  phase = p;
+	  for( int i = 0; i < reps.size(); i++ ){
+		 table.key[p][i] = compactID(reps[i]) & keyBits[which][p];
 	  }
    }
-   return startState;
+   phase = oldPhase;
+   return table;
 }
 
+struct coordTables {
+   coordTable coord[COORDS];
+};
 
-// Initialize a cube's solved state
-vi initialize(){
-   vi state{UF,UR, UB, UL, FR, FL, BR, BL, DF, DR, DB, DL, UFR, UBR, UBL,
-	  UFL, DFR, DBR, DBL, DFL};
-   for(int i = 0; i < 20; i++){
-	  state.push_back(0);
+coordTables buildTables(){
+   coordTables tables;
+   for( int i = 0; i < COORDS; i++ ){
+	  tables.coord[i] = buildCoord(i);
    }
-   return state;
+   return tables;
 }
 
+// The tables are built on first use, one copy per NUMA node
+const coordTables & moveTables(){
+   static numaReplica<coordTables> replicas(buildTables, 8 << 20);
+   return replicas.local();
+}
 
-vector<string> movesString{ "R", "L", "F", "B", "U", "D", "R2", "L2", "F2", 
-   "B2", "U2", "D2", "R'", "L'", "F'", "B'", "U'", "D'" };
+// A cube as coordinate indices
+struct cubeCoord {
+   int c[COORDS];
+};
 
-// Add phase paths into a single string
-void build_path( vi path, string & build ){
-   for( int i = 0; i < path.size(); i++ ){
-	  build += ( movesString[path[i]] + " " );
+// Returns false if the cube has no coordinate, which happens when its
+// orientations or permutations cannot occur on a real cube
+bool toCoord(const coordTables & tables, const vi & state, cubeCoord & coord){
+   for( int i = 0; i < COORDS; i++ ){
+	  unordered_map<ull,int>::const_iterator it =
+		 tables.coord[i].index.find( rawCoord[i](state) );
+	  if( it == tables.coord[i].index.end() ){
+		 return false;
+	  }
+	  coord.c[i] = it->second;
    }
+   return true;
 }
 
-// Apply random moves 0-17 to a state and return the path
-vi scramble(int number_of_moves, vi & state){
-   int random;
-   srand(time(NULL));
-   vi path;
+cubeCoord moveCoord(const coordTables & tables, const cubeCoord & coord,
+	  int move){
+   cubeCoord next;
+   for( int i = 0; i < COORDS; i++ ){
+	  next.c[i] = tables.coord[i].next[ coord.c[i] * 18 + move ];
+   }
+   return next;
+}
 
-   for( int i = 0; i < number_of_moves; i++){
-	  random = rand()%18;
-	  state = applyMove(random, state);
-	  path.push_back(random);
+// Search key of a cube for the current phase. Phase 4 needs the whole cube,
+// so its key is a mixed radix number over the permutation coordinates.
+ull phaseKey(const coordTables & tables, const cubeCoord & coord){
+   if( phase == 4 ){
+	  ull key = coord.c[CPERM];
+	  for( int i = MEDGES; i <= SEDGES; i++ ){
+		 key = key * ( tables.coord[i].next.size() / 18 ) + coord.c[i];
+	  }
+	  return key;
    }
-   return path;
+   ull key = 0;
+   for( int i = 0; i < COORDS; i++ ){
+	  key |= tables.coord[i].key[phase][ coord.c[i] ];
+   }
+   return key;
 }
 
 
-// For a specified amount of solves, scramble a cube for a certain amount of
-// moves, and return the solution 
-int main(int argc, char** argv){
+// Entry of the search table for one visited phase ID
+struct searchNode {
+   ull pred; // key of the node this one was reached from
+   char dir; // 1 - seen from the forward search, 2 - from the backward search
+   char move; // move applied to pred to reach this node, -1 for the roots
+   float cost; // cost from the root, weightedSearch() only
+};
 
-   int averageMovesPerformed = 0;
-   int averagePathLength = 0;
-   // initialize a cube in its solved state
-   for( int i = 0; i < 1; i++ ){
+//--- Memory for the search tables. Ask for 2 MB huge pages first; when none
+//are reserved fall back to ordinary pages and let transparent huge pages
+//back them if the kernel allows. bytes is rounded up to whole huge pages.
+const size_t HUGE_PAGE = 2 << 20;
+
+void * hugeAlloc(size_t & bytes){
+   bytes = ( bytes + HUGE_PAGE - 1 ) / HUGE_PAGE * HUGE_PAGE;
+   void * memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   if( memory != MAP_FAILED ){
+	  return memory;
+   }
+   memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if( memory == MAP_FAILED ){
+	  throw bad_alloc();
+   }
+   madvise(memory, bytes, MADV_HUGEPAGE);
+   return memory;
+}
 
-	  totalMoves = 0;
+void hugeFree(void * memory, size_t bytes){
+   munmap(memory, bytes);
+}
 
-	  // initialize a blank cube
-	  vi cube = initialize();
-	  vi goalCube = initialize();
+//--- Open addressing hash table from phase key to searchNode, kept in one
+//flat huge page block so a probe is usually a single cache line and a
+//single TLB entry. Never more than half full.
+class visitedTable {
+   public:
+	  visitedTable() : slots(NULL), count(0) {
+		 allocate(16);
+	  }
+	  ~visitedTable(){
+		 hugeFree(slots, bytes);
+	  }
 
-	  // Scramble the cube
-	  vi scramble_path = scramble(30, cube);
-	  string sp;
-	  build_path(scramble_path, sp);
+	  // NULL if key has not been seen
+	  searchNode * find(ull key){
+		 for( size_t i = home(key); ; i = ( i+1 ) & mask ){
+			if( slots[i].key == key ){
+			   return &slots[i].node;
+			}
+			if( slots[i].key == EMPTY ){
+			   return NULL;
+			}
+		 }
+	  }
 
-	  // begin solving cube by iteratively going through the 4 phases
-	  vi path; // intermediate phase solution
-	  string build; // complete solution string
+	  // Add a key that is not in the table yet
+	  void insert(ull key, const searchNode & node){
+		 if( 2 * ( count + 1 ) > mask + 1 ){
+			grow();
+		 }
+		 place(key, node);
+	  }
 
-	  phase = 1;
-	  path = BDBFS( cube, goalCube );
-	  build_path(path, build);
-	  averagePathLength += path.size();
+	  // Pull the home slot of key into cache ahead of a find()
+	  void prefetch(ull key){
+		 __builtin_prefetch(&slots[home(key)]);
+	  }
 
-	  phase = 2;
-	  path = BDBFS( cube, goalCube );
-	  averagePathLength += path.size();
-	  build_path(path, build);
+	  size_t size(){ return count; }
 
-	  phase = 3;
-	  path = BDBFS( cube, goalCube );
-	  averagePathLength += path.size();
-	  build_path(path, build);
+	  // Bytes mapped for the table
+	  size_t memory(){ return bytes; }
+
+	  // Drop every entry and give the memory back
+	  void clear(){
+		 hugeFree(slots, bytes);
+		 count = 0;
+		 allocate(16);
+	  }
+
+	  // Bytes mapped at the peak of growing, when old and new block both
+	  // exist, or 0 if the next insert does not grow the table
+	  size_t growthMemory(){
+		 return ( 2 * ( count + 1 ) > mask + 1 ) ? 3 * bytes : 0;
+	  }
 
-	  phase = 4;
-	  path = BDBFS( cube, goalCube );
-	  averagePathLength += path.size();
-	  build_path(path, build);
+   private:
+	  static const ull EMPTY = ~0ULL; // never a valid phase key
 
-	  // Print scramble path, solution
-	  cout << sp << endl;
-	  cout << build << endl;
+	  struct slot {
+		 ull key;
+		 searchNode node;
+	  };
+
+	  size_t home(ull key){
+		 return ( key * 0x9e3779b97f4a7c15ULL ) >> shift;
+	  }
+
+	  void allocate(int bits){
+		 bytes = sizeof(slot) << bits;
+		 slots = (slot *)hugeAlloc(bytes);
+		 // use every slot of the rounded up block
+		 bits = 0;
+		 while( ( sizeof(slot) << ( bits+1 ) ) <= bytes ){
+			bits++;
+		 }
+		 mask = ( (size_t)1 << bits ) - 1;
+		 shift = 64 - bits;
+		 for( size_t i = 0; i <= mask; i++ ){
+			slots[i].key = EMPTY;
+		 }
+	  }
+
+	  void place(ull key, const searchNode & node){
+		 size_t i = home(key);
+		 while( slots[i].key != EMPTY ){
+			i = ( i+1 ) & mask;
+		 }
+		 slots[i].key = key;
+		 slots[i].node = node;
+		 count++;
+	  }
+
+	  void grow(){
+		 slot * old = slots;
+		 size_t oldBytes = bytes;
+		 size_t oldSize = mask + 1;
+		 allocate(65 - shift); // twice as many slots
+		 count = 0;
+		 for( size_t i = 0; i < oldSize; i++ ){
+			if( old[i].key != EMPTY ){
+			   place(old[i].key, old[i].node);
+			}
+		 }
+		 hugeFree(old, oldBytes);
+	  }
+
+	  slot * slots;
+	  size_t bytes;
+	  size_t mask;
+	  int shift;
+	  size_t count;
+};
+
+// Replay the moves leading to a visited key to get a representative cube
+// for it. Frontiers only keep keys, cubes are rebuilt when expanded. roots
+// holds the cube of every forward root (numbered by its pred) and, last, the
+// goal cube.
+cubeCoord rebuildCoord(ull key, visitedTable & visited,
+	  const vector<cubeCoord> & roots, const coordTables & tables){
+   int moves[64];
+   int depth = 0;
+   searchNode * node = visited.find(key);
+   while( node->move >= 0 ){
+	  moves[depth++] = node->move;
+	  node = visited.find(node->pred);
+   }
+   cubeCoord coord = ( node->dir == 1 ) ? roots[node->pred] : roots.back();
+   while( depth > 0 ){
+	  coord = moveCoord(tables, coord, moves[--depth]);
+   }
+   return coord;
+}
+
+// Record that a search ended without reaching its goal
+void markUnsolvable(solveBudget * budget){
+   if( budget && budget->status == SOLVED ){
+	  budget->status = UNSOLVABLE;
+   }
+}
+
+// Record the memory a search is holding in budget->peakMemory
+void notePeak(solveBudget * budget, size_t bytes){
+   if( budget && bytes > budget->peakMemory ){
+	  budget->peakMemory = bytes;
+   }
+}
+
+//--- Low memory fallback for BDBFS once its table reaches the memory limit.
+// Iterative deepening from the start cube with the table frozen: every key
+// the backward search reached is a known distance from the goal, so the
+// depth-first search only has to reach one of them. Forward keys deeper than
+// the forward search got are pruned, they were already reached more cheaply.
+struct perimeterSearch {
+   const coordTables & tables;
+   visitedTable & visited;
+   solveBudget * budget;
+   int forwardDepth; // levels the forward search completed
+   vi path; // moves of the current depth-first branch
+   ull meetID; // backward key the search ended on
+
+   perimeterSearch(const coordTables & tables, visitedTable & visited,
+		 solveBudget * budget, int forwardDepth)
+	  : tables(tables), visited(visited), budget(budget),
+	  forwardDepth(forwardDepth) {}
+
+   // 1 - found, 0 - not within bound, -1 - budget ran out
+   int search(const cubeCoord & coord, int bound){
+	  if( budget && ( ++budget->nodes % BUDGET_CHECK_INTERVAL == 0 ) &&
+			budgetExhausted(budget) ){
+		 return -1;
+	  }
+	  const vi & moveSet = applicableMoves[phase];
+	  for( int i = 0; i < moveSet.size(); i++ ){
+		 int move = moveSet[i];
+		 if( !path.empty() && move == inverse(path.back()) ){
+			continue;
+		 }
+		 totalMoves++; // helpful data gathering
+		 cubeCoord next = moveCoord(tables, coord, move);
+		 ull key = phaseKey(tables, next);
+		 searchNode * seen = visited.find(key);
+		 path.push_back(move);
+		 if( seen && seen->dir == 2 ){
+			meetID = key;
+			return 1;
+		 }
+		 if( path.size() < bound &&
+			   !( seen && path.size() > forwardDepth + 1 ) ){
+			int found = search(next, bound);
+			if( found != 0 ){
+			   return found;
+			}
+		 }
+		 path.pop_back();
+	  }
+	  return 0;
+   }
+};
+
+// Maximum depth tried by the low memory fallback before giving up
+const int PERIMETER_MAX_DEPTH = 24;
+
+// Bidirectional Breadth First Search
+// Both searches grow one full level at a time, and we always grow the side
+// with the smaller frontier. With a budget the search gives up, returning an
+// empty path and recording the reason in budget->status, once it runs out.
+// When the table would outgrow budget->memoryLimit it stops growing and the
+// rest of the phase is left to a perimeterSearch.
+vi BDBFS(vi & startState, vi goalState, solveBudget * budget = NULL){
+
+   // compute start state ID, goal state ID
+   const coordTables & tables = moveTables();
+   vector<cubeCoord> roots(2);
+   if( !toCoord(tables, startState, roots[0]) ||
+		 !toCoord(tables, goalState, roots[1]) ){
+	  markUnsolvable(budget);
+	  return vi();
+   }
+   ull startID = phaseKey(tables, roots[0]);
+   ull goalID = phaseKey(tables, roots[1]);
+
+   // Already in phase, return
+   if( startID == goalID ){
+	  vi retPath;
+	  return retPath;
+   }
+
+   // initialize table for BFS
+   visitedTable visited;
+   searchNode root = { 0, 1, -1 };
+   visited.insert(startID, root);
+   root.pred = goalID;
+   root.dir = 2;
+   visited.insert(goalID, root);
+
+   // frontier[1] - forward search, frontier[2] - backward search
+   vector<ull> frontier[3];
+   frontier[1].push_back(startID);
+   frontier[2].push_back(goalID);
+
+   const vi & moveSet = applicableMoves[phase];
+   ull newIDs[18];
+   int forwardDepth = 0;
+   vi path;
+
+   // begin BFS for particular phase
+   while( !frontier[1].empty() && !frontier[2].empty() ){
+
+	  int side = ( frontier[1].size() <= frontier[2].size() ) ? 1 : 2;
+	  vector<ull> next;
+
+	  for( int f = 0; f < frontier[side].size(); f++ ){
+		 ull oldID = frontier[side][f];
+		 if( budget && ( ++budget->nodes % BUDGET_CHECK_INTERVAL == 0 ) &&
+			   budgetExhausted(budget) ){
+			notePeak(budget, visited.memory() + 8 * ( next.size() +
+					 frontier[1].size() + frontier[2].size() ) );
+			vi retPath;
+			return retPath;
+		 }
+		 cubeCoord oldCoord = rebuildCoord(oldID, visited, roots, tables);
+
+		 // Compute every successor key and start loading its table slot
+		 // before looking any of them up
+		 for( int i = 0; i < moveSet.size(); i++ ){
+			newIDs[i] = phaseKey(tables, moveCoord(tables, oldCoord, moveSet[i]));
+			visited.prefetch(newIDs[i]);
+		 }
+
+		 for( int i = 0; i < moveSet.size(); i++ ){
+			int move = moveSet[i];
+			ull newID = newIDs[i];
+			totalMoves++; // helpful data gathering
+
+			searchNode * seen = visited.find(newID);
+
+			// out of memory, finish with the table as it is
+			if( !seen && budget && budget->memoryLimit &&
+				  visited.growthMemory() > budget->memoryLimit ){
+			   notePeak(budget, visited.memory() + 8 * ( next.size() +
+						frontier[1].size() + frontier[2].size() ) );
+			   vector<ull>().swap(next);
+			   vector<ull>().swap(frontier[1]);
+			   vector<ull>().swap(frontier[2]);
+
+			   perimeterSearch dfs(tables, visited, budget, forwardDepth);
+			   int found = 0;
+			   for( int bound = 1; bound <= PERIMETER_MAX_DEPTH && !found;
+					 bound++ ){
+				  found = dfs.search(roots[0], bound);
+			   }
+			   notePeak(budget, visited.memory());
+			   if( found == 0 ){
+				  markUnsolvable(budget);
+			   }
+			   if( found != 1 ){
+				  return path;
+			   }
+			   path = dfs.path;
+			   for( ull bwdID = dfs.meetID; bwdID != goalID; ){
+				  searchNode * node = visited.find(bwdID);
+				  path.push_back(inverse(node->move));
+				  bwdID = node->pred;
+			   }
+			   for( int i = 0; i < path.size(); i++ ){
+				  startState = applyMove(path[i], startState);
+			   }
+			   return path;
+			}
+
+			// only insert into the next level if we have not seen this ID
+			if( !seen ){
+			   searchNode node = { oldID, (char)side, (char)move };
+			   visited.insert(newID, node);
+			   next.push_back(newID);
+			   continue;
+			}
+
+			//--- seen from the other search, we have found a connecting path
+			if( seen->dir != side ){
+
+			   // forward end and backward end of the connecting move
+			   ull fwdID = ( side == 1 ) ? oldID : newID;
+			   ull bwdID = ( side == 1 ) ? newID : oldID;
+			   notePeak(budget, visited.memory() + 8 * ( next.size() +
+						frontier[1].size() + frontier[2].size() ) );
+
+			   // rebuild path from fwdID -> startID
+			   while( fwdID != startID ){
+				  searchNode * node = visited.find(fwdID);
+				  path.insert(path.begin(), node->move);
+				  fwdID = node->pred;
+			   }
+
+			   // Applying connecting move
+			   path.push_back( ( side == 1 ) ? move : inverse(move) );
+
+			   // rebuild path from bwdID -> goalID
+			   while( bwdID != goalID ){
+				  searchNode * node = visited.find(bwdID);
+				  path.push_back(inverse(node->move));
+				  bwdID = node->pred;
+			   }
+
+			   // Applying path to input starting state
+			   for( int i = 0; i < path.size(); i++ ){
+				  startState = applyMove(path[i], startState);
+			   }
+			   return path;
+			}
+		 }
+	  }
+	  if( side == 1 ){
+		 forwardDepth++;
+	  }
+	  frontier[side].swap(next);
+   }
+   notePeak(budget, visited.memory());
+   markUnsolvable(budget);
+   return path;
+}
+
+
+//--- A partial solution kept in the beam: the cube after path
+struct beamCandidate {
+   vi state;
+   vi path;
+};
+
+bool shorterPath(const beamCandidate & a, const beamCandidate & b){
+   return a.path.size() < b.path.size();
+}
+
+// Bidirectional search for the current phase from several starting cubes at
+// once, returning up to k of the shortest complete paths. All candidates
+// share one table and one backward search. A candidate whose path is longer
+// than the shortest one joins the forward search that many levels late, and
+// only enters the table when it joins, so results are ordered by total
+// length rather than by phase length. Levels are added past the first
+// connection until no later one can beat the k best found.
+vector<beamCandidate> BDBFSMulti(vector<beamCandidate> candidates,
+	  vi goalState, int k, solveBudget * budget = NULL){
+
+   vector<beamCandidate> results;
+   sort(candidates.begin(), candidates.end(), shorterPath);
+   const coordTables & tables = moveTables();
+   vector<cubeCoord> roots( candidates.size() + 1 );
+   for( int r = 0; r <= candidates.size(); r++ ){
+	  const vi & state = ( r < candidates.size() ) ? candidates[r].state
+		 : goalState;
+	  if( !toCoord(tables, state, roots[r]) ){
+		 markUnsolvable(budget);
+		 return results;
+	  }
+   }
+   ull goalID = phaseKey(tables, roots.back());
+
+   // Already in phase, keep as they are
+   for( int r = 0; r < candidates.size(); r++ ){
+	  if( phaseKey(tables, roots[r]) == goalID ){
+		 results.push_back(candidates[r]);
+	  }
+   }
+   if( !results.empty() ){
+	  if( results.size() > k ){
+		 results.resize(k);
+	  }
+	  return results;
+   }
+
+   // Candidates by how many levels after the shortest one they join
+   int shortest = candidates[0].path.size();
+   vector<vi> pending;
+   for( int r = 0; r < candidates.size(); r++ ){
+	  int offset = candidates[r].path.size() - shortest;
+	  if( pending.size() <= offset ){
+		 pending.resize(offset + 1);
+	  }
+	  pending[offset].push_back(r);
+   }
+
+   // Roots point at their candidate through pred
+   visitedTable visited;
+   searchNode root = { goalID, 2, -1 };
+   visited.insert(goalID, root);
+
+   // Connections found, as (forward key, backward key). Both searches can
+   // find the same one, it is only kept once.
+   set< pair<ull,ull> > met;
+
+   // Add the path of a connection to results: candidate r, then the forward
+   // moves in path, then the backward search from bwdID to the goal
+   auto connect = [&](int r, vi path, ull bwdID){
+	  while( bwdID != goalID ){
+		 searchNode * node = visited.find(bwdID);
+		 path.push_back(inverse(node->move));
+		 bwdID = node->pred;
+	  }
+	  beamCandidate found = candidates[r];
+	  for( int i = 0; i < path.size(); i++ ){
+		 found.state = applyMove(path[i], found.state);
+		 found.path.push_back(path[i]);
+	  }
+	  results.push_back(found);
+   };
+
+   // frontier[1] - forward search, frontier[2] - backward search
+   vector<ull> frontier[3];
+   frontier[2].push_back(goalID);
+   int depth[3] = { 0, 0, 0 }; // levels completed by each search
+
+   // Let the candidates of a level join the forward search. One whose key
+   // the forward search already reached is no shorter than the candidate
+   // that got there first, one the backward search reached is a complete
+   // path.
+   auto join = [&](int level){
+	  if( level >= pending.size() ){
+		 return;
+	  }
+	  for( int j = 0; j < pending[level].size(); j++ ){
+		 int r = pending[level][j];
+		 ull key = phaseKey(tables, roots[r]);
+		 searchNode * seen = visited.find(key);
+		 if( !seen ){
+			searchNode node = { (ull)r, 1, -1 };
+			visited.insert(key, node);
+			frontier[1].push_back(key);
+		 }
+		 else if( seen->dir == 2 && met.insert( make_pair(key, key) ).second ){
+			connect(r, vi(), key);
+		 }
+	  }
+   };
+
+   // True once the k best results are known. A connection not found yet
+   // is one move longer than both searches have gone, unless it starts at
+   // a candidate that has not been expanded: that one is still at least a
+   // move from the goal.
+   auto settled = [&](){
+	  if( results.size() < k ){
+		 return false;
+	  }
+	  stable_sort(results.begin(), results.end(), shorterPath);
+	  int bound = depth[1] + depth[2] + 1;
+	  for( int level = depth[1]; level < pending.size(); level++ ){
+		 if( !pending[level].empty() ){
+			bound = min( bound, level + 1 );
+			break;
+		 }
+	  }
+	  return results[k-1].path.size() <= shortest + bound;
+   };
+
+   const vi & moveSet = applicableMoves[phase];
+   ull newIDs[18];
+   join(0);
+
+   while( !settled() &&
+		 ( !frontier[1].empty() || depth[1] + 1 < pending.size() ) &&
+		 !frontier[2].empty() ){
+
+	  int side = ( frontier[1].size() <= frontier[2].size() ) ? 1 : 2;
+	  vector<ull> next;
+
+	  for( int f = 0; f < frontier[side].size(); f++ ){
+		 ull oldID = frontier[side][f];
+		 if( budget && ( ++budget->nodes % BUDGET_CHECK_INTERVAL == 0 ) &&
+			   budgetExhausted(budget) ){
+			notePeak(budget, visited.memory());
+			results.clear();
+			return results;
+		 }
+
+		 cubeCoord oldCoord = rebuildCoord(oldID, visited, roots, tables);
+
+		 for( int i = 0; i < moveSet.size(); i++ ){
+			newIDs[i] = phaseKey(tables, moveCoord(tables, oldCoord, moveSet[i]));
+			visited.prefetch(newIDs[i]);
+		 }
+
+		 for( int i = 0; i < moveSet.size(); i++ ){
+			int move = moveSet[i];
+			ull newID = newIDs[i];
+			totalMoves++; // helpful data gathering
+
+			searchNode * seen = visited.find(newID);
+
+			// out of memory, give up the beam and finish the shortest
+			// candidate with the plain search and its low memory fallback
+			if( !seen && budget && budget->memoryLimit &&
+				  visited.growthMemory() > budget->memoryLimit ){
+			   notePeak(budget, visited.memory());
+			   visited.clear();
+			   results.assign(1, candidates[0]);
+			   vi path = BDBFS(results[0].state, goalState, budget);
+			   results[0].path.insert(results[0].path.end(), path.begin(),
+					 path.end());
+			   if( budget->status != SOLVED ){
+				  results.clear();
+			   }
+			   return results;
+			}
+
+			if( !seen ){
+			   searchNode node = { oldID, (char)side, (char)move };
+			   visited.insert(newID, node);
+			   next.push_back(newID);
+			   continue;
+			}
+			if( seen->dir == side ){
+			   continue;
+			}
+
+			//--- a connecting path
+			ull fwdID = ( side == 1 ) ? oldID : newID;
+			ull bwdID = ( side == 1 ) ? newID : oldID;
+			if( !met.insert( make_pair(fwdID, bwdID) ).second ){
+			   continue;
+			}
+			vi path;
+			searchNode * node = visited.find(fwdID);
+			while( node->move >= 0 ){
+			   path.insert(path.begin(), node->move);
+			   node = visited.find(node->pred);
+			}
+			path.push_back( ( side == 1 ) ? move : inverse(move) );
+			connect(node->pred, path, bwdID);
+		 }
+	  }
+
+	  frontier[side].swap(next);
+	  depth[side]++;
+	  if( side == 1 ){
+		 join(depth[1]);
+	  }
+   }
+   notePeak(budget, visited.memory());
+
+   if( results.empty() ){
+	  markUnsolvable(budget);
+	  return results;
+   }
+   stable_sort(results.begin(), results.end(), shorterPath);
+   if( results.size() > k ){
+	  results.resize(k);
+   }
+   return results;
+}
+
+
+vector<string> movesString{ "R", "L", "F", "B", "U", "D", "R2", "L2", "F2", 
+   "B2", "U2", "D2", "R'", "L'", "F'", "B'", "U'", "D'" };
+
+//--- Cost weighted search
+// Cost of a path under a per move cost table
+double pathCost(const vi & path, const vector<double> & moveCost){
+   double cost = 0;
+   for( int i = 0; i < path.size(); i++ ){
+	  cost += moveCost[path[i]];
+   }
+   return cost;
+}
+
+typedef pair<float, ull> queued; // (cost from root, key)
+
+// Bidirectional Dijkstra for the current phase, returning the path of least
+// total moveCost instead of the fewest moves. Forward and backward search
+// have their own table, each node keeping its cost in searchNode::cost. A
+// backward step m stands for the forward move inverse(m) and is charged as
+// that. We stop once the two cheapest open nodes cannot beat the best
+// connection found so far. If the tables together would outgrow
+// budget->memoryLimit the phase is finished by BDBFS() instead, which keeps
+// to the limit but only minimises the number of moves.
+vi weightedSearch(vi & startState, vi goalState, const vector<double> & moveCost,
+	  solveBudget * budget = NULL){
+
+   const coordTables & tables = moveTables();
+   vector<cubeCoord> roots(2);
+   if( !toCoord(tables, startState, roots[0]) ||
+		 !toCoord(tables, goalState, roots[1]) ){
+	  markUnsolvable(budget);
+	  return vi();
+   }
+   ull startID = phaseKey(tables, roots[0]);
+   ull goalID = phaseKey(tables, roots[1]);
+
+   vi path;
+   if( startID == goalID ){
+	  return path;
+   }
+
+   // visited[0] - forward search, visited[1] - backward search, always
+   // indexed by side - 1
+   visitedTable visited[2];
+   searchNode root = { 0, 1, -1, 0 };
+   visited[0].insert(startID, root);
+   root.pred = goalID;
+   root.dir = 2;
+   visited[1].insert(goalID, root);
+
+   priority_queue< queued, vector<queued>, greater<queued> > open[2];
+   open[0].push( queued(0, startID) );
+   open[1].push( queued(0, goalID) );
+
+   const vi & moveSet = applicableMoves[phase];
+   float best = numeric_limits<float>::infinity();
+   ull meetID = 0;
+
+   while( !open[0].empty() && !open[1].empty() &&
+		 open[0].top().first + open[1].top().first < best ){
+
+	  int side = ( open[0].size() <= open[1].size() ) ? 1 : 2;
+	  int other = 3 - side;
+	  queued top = open[side - 1].top();
+	  open[side - 1].pop();
+	  if( top.first > visited[side - 1].find(top.second)->cost ){
+		 continue; // stale entry, reached more cheaply since
+	  }
+	  if( budget && ( ++budget->nodes % BUDGET_CHECK_INTERVAL == 0 ) &&
+			budgetExhausted(budget) ){
+		 notePeak(budget, visited[0].memory() + visited[1].memory() +
+			   sizeof(queued) * ( open[0].size() + open[1].size() ) );
+		 return path;
+	  }
+
+	  cubeCoord oldCoord = rebuildCoord(top.second, visited[side - 1], roots,
+			tables);
+	  for( int i = 0; i < moveSet.size(); i++ ){
+		 int move = moveSet[i];
+		 totalMoves++; // helpful data gathering
+		 float cost = top.first +
+			moveCost[ ( side == 1 ) ? move : inverse(move) ];
+		 ull newID = phaseKey(tables, moveCoord(tables, oldCoord, move));
+
+		 searchNode * seen = visited[side - 1].find(newID);
+		 if( seen && seen->cost <= cost ){
+			continue;
+		 }
+		 if( seen ){
+			seen->pred = top.second;
+			seen->move = move;
+			seen->cost = cost;
+		 }
+		 else{
+			// out of memory, hand the phase to the plain search
+			size_t queues = sizeof(queued) * ( open[0].size() +
+				  open[1].size() + 1 );
+			if( budget && budget->memoryLimit &&
+				  max( visited[side - 1].growthMemory(), visited[side - 1].memory() ) +
+				  visited[other - 1].memory() + queues > budget->memoryLimit ){
+			   notePeak(budget, visited[0].memory() + visited[1].memory() +
+					 queues);
+			   for( int s = 1; s <= 2; s++ ){
+				  visited[s - 1].clear();
+				  priority_queue< queued, vector<queued>,
+					 greater<queued> >().swap(open[s - 1]);
+			   }
+			   return BDBFS(startState, goalState, budget);
+			}
+			searchNode node = { top.second, (char)side, (char)move, cost };
+			visited[side - 1].insert(newID, node);
+		 }
+		 open[side - 1].push( queued(cost, newID) );
+
+		 searchNode * across = visited[other - 1].find(newID);
+		 if( across && cost + across->cost < best ){
+			best = cost + across->cost;
+			meetID = newID;
+		 }
+	  }
+   }
+   notePeak(budget, visited[0].memory() + visited[1].memory() +
+		 sizeof(queued) * ( open[0].size() + open[1].size() ) );
+
+   if( best == numeric_limits<float>::infinity() ){
+	  if( open[0].empty() || open[1].empty() ){
+		 markUnsolvable(budget);
+	  }
+	  return path;
+   }
+   // rebuild path from meetID -> startID, then meetID -> goalID
+   for( ull fwdID = meetID; fwdID != startID; ){
+	  searchNode * node = visited[0].find(fwdID);
+	  path.insert(path.begin(), node->move);
+	  fwdID = node->pred;
+   }
+   for( ull bwdID = meetID; bwdID != goalID; ){
+	  searchNode * node = visited[1].find(bwdID);
+	  path.push_back(inverse(node->move));
+	  bwdID = node->pred;
+   }
+   for( int i = 0; i < path.size(); i++ ){
+	  startState = applyMove(path[i], startState);
+   }
+   return path;
+}
+
+
+// Add phase paths into a single string
+void build_path( vi path, string & build ){
+   for( int i = 0; i < path.size(); i++ ){
+	  build += movesString[path[i]];
+	  build += ' ';
+   }
+}
+
+//--- Compact binary paths
+// A record is the move count as a base-128 varint followed by the moves as
+// 5 bit codes (0-17, same numbering as movesString), packed low bits first
+// and padded to a whole byte. A 40 move solution takes 26 bytes.
+
+// Append one path record to out
+void encode_path( const vi & path, string & out ){
+   unsigned int length = path.size();
+   while( length >= 0x80 ){
+	  out += (char)( ( length & 0x7f ) | 0x80 );
+	  length >>= 7;
+   }
+   out += (char)length;
+
+   unsigned int bits = 0;
+   int held = 0;
+   for( int i = 0; i < path.size(); i++ ){
+	  bits |= (unsigned int)path[i] << held;
+	  held += 5;
+	  while( held >= 8 ){
+		 out += (char)( bits & 0xff );
+		 bits >>= 8;
+		 held -= 8;
+	  }
+   }
+   if( held > 0 ){
+	  out += (char)bits;
+   }
+}
+
+// Read one path record starting at data, advancing data past it.
+// Returns 1 - read, 0 - the record is not complete before end, -1 - not a
+// valid record (a length over 32 bits or a move code above 17). data is
+// left alone unless a record was read.
+int decode_path( const unsigned char *& data, const unsigned char * end,
+	  vi & path ){
+   const unsigned char * p = data;
+   unsigned int length = 0;
+   int shift = 0;
+   do{
+	  if( shift > 28 ){
+		 return -1;
+	  }
+	  if( p == end ){
+		 return 0;
+	  }
+	  length |= (unsigned int)( *p & 0x7f ) << shift;
+	  shift += 7;
+   } while( *p++ & 0x80 );
+
+   // 64 bit arithmetic, a 32 bit length * 5 would wrap
+   if( (ull)( end - p ) < ( (ull)length * 5 + 7 ) / 8 ){
+	  return 0;
+   }
+   path.clear();
+   unsigned int bits = 0;
+   int held = 0;
+   for( unsigned int i = 0; i < length; i++ ){
+	  if( held < 5 ){
+		 bits |= (unsigned int)*p++ << held;
+		 held += 8;
+	  }
+	  if( ( bits & 0x1f ) > 17 ){
+		 return -1;
+	  }
+	  path.push_back( bits & 0x1f );
+	  bits >>= 5;
+	  held -= 5;
+   }
+   data = p;
+   return 1;
+}
+
+// Collects encoded records and writes them out in large blocks
+class pathWriter {
+   public:
+	  pathWriter(int fd, size_t blockSize = 1 << 20)
+		 : fd(fd), blockSize(blockSize) {
+		 buffer.reserve(blockSize + 64);
+	  }
+	  ~pathWriter(){ flush(); }
+
+	  // Returns false, with errno set, once a write has failed
+	  bool write( const vi & path ){
+		 encode_path(path, buffer);
+		 if( buffer.size() >= blockSize ){
+			return flush();
+		 }
+		 return true;
+	  }
+
+	  // Returns false, with errno set, if the buffer could not be written.
+	  // What was not written stays buffered.
+	  bool flush(){
+		 size_t done = 0;
+		 while( done < buffer.size() ){
+			ssize_t n = ::write(fd, buffer.data() + done, buffer.size() - done);
+			if( n < 0 && errno == EINTR ){
+			   continue;
+			}
+			if( n <= 0 ){
+			   buffer.erase(0, done);
+			   if( n == 0 ){
+				  errno = EIO;
+			   }
+			   return false;
+			}
+			done += n;
+		 }
+		 buffer.clear();
+		 return true;
+	  }
+
+   private:
+	  int fd;
+	  size_t blockSize;
+	  string buffer;
+};
+
+// Decodes a stream of records from a file descriptor, one path at a time
+class pathReader {
+   public:
+	  // END - clean end of the stream, TRUNCATED - it ended inside a record,
+	  // MALFORMED - a record failed decode_path(), FAILED - read() failed
+	  enum readStatus { READING, END, TRUNCATED, MALFORMED, FAILED };
+
+	  pathReader(int fd) : fd(fd), pos(0), state(READING) {}
+
+	  // Returns false once no more records can be read, status() says why
+	  bool read( vi & path ){
+		 while( state == READING ){
+			const unsigned char * data =
+			   (const unsigned char *)buffer.data() + pos;
+			const unsigned char * end =
+			   (const unsigned char *)buffer.data() + buffer.size();
+			int found = decode_path(data, end, path);
+			if( found == 1 ){
+			   pos = data - (const unsigned char *)buffer.data();
+			   return true;
+			}
+			if( found < 0 ){
+			   state = MALFORMED;
+			   break;
+			}
+			// keep the partial record and read more
+			buffer.erase(0, pos);
+			pos = 0;
+			char chunk[1 << 16];
+			ssize_t n = ::read(fd, chunk, sizeof(chunk));
+			if( n < 0 && errno == EINTR ){
+			   continue;
+			}
+			if( n < 0 ){
+			   state = FAILED;
+			}
+			else if( n == 0 ){
+			   state = buffer.empty() ? END : TRUNCATED;
+			}
+			else{
+			   buffer.append(chunk, n);
+			}
+		 }
+		 return false;
+	  }
+
+	  readStatus status() const { return state; }
+
+   private:
+	  int fd;
+	  size_t pos;
+	  string buffer;
+	  readStatus state;
+};
+
+
+//--- Counter based random numbers (SplitMix64 output function). Each value
+//depends only on (seed, stream, counter), so runs are reproducible and every
+//worker thread can take its own stream without sharing any state.
+class cubeRandom {
+   public:
+	  cubeRandom(ull seed, ull stream = 0)
+		 : key( mix( seed ^ mix( stream + 0x632be59bd9b4e019ULL ) ) ),
+		 counter(0) {}
+
+	  ull next(){
+		 return mix( key + 0x9e3779b97f4a7c15ULL * ++counter );
+	  }
+
+	  // Uniform value in [0, bound)
+	  ull below(ull bound){
+		 ull threshold = ( 0 - bound ) % bound;
+		 ull value;
+		 do{
+			value = next();
+		 } while( value < threshold );
+		 return value % bound;
+	  }
+
+   private:
+	  static ull mix(ull z){
+		 z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+		 z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+		 return z ^ ( z >> 31 );
+	  }
+
+	  ull key;
+	  ull counter;
+};
+
+// Uniformly random solvable cube. Both permutations are drawn by rank, then
+// two edges are swapped when their parities differ (a bijection from the odd
+// to the even half, so the result stays uniform). The last edge and corner
+// orientations are chosen so the totals are 0 mod 2 and 0 mod 3.
+vi randomState(cubeRandom & rng){
+   int edges[12];
+   int corners[8];
+   int edgeParity = permUnrank(rng.below(479001600), edges, 12);
+   int cornerParity = permUnrank(rng.below(40320), corners, 8);
+   if( edgeParity != cornerParity ){
+	  swap( edges[10], edges[11] );
+   }
+
+   vi state(40);
+   for( int i = 0; i < 12; i++ ){
+	  state[i] = edges[i];
+   }
+   for( int i = 0; i < 8; i++ ){
+	  state[i+12] = corners[i] + 12;
+   }
+
+   ull bits = rng.next();
+   int flips = 0;
+   for( int i = 0; i < 11; i++ ){
+	  state[i+20] = ( bits >> i ) & 1;
+	  flips += state[i+20];
+   }
+   state[31] = flips % 2;
+
+   ull twists = rng.below(2187); // 3^7
+   int twist = 0;
+   for( int i = 0; i < 7; i++ ){
+	  state[i+32] = twists % 3;
+	  twists /= 3;
+	  twist += state[i+32];
+   }
+   state[39] = ( 3 - twist % 3 ) % 3;
+   return state;
+}
+
+// Append state as 40 space separated values, the server's request format
+void appendState(const vi & state, string & out){
+   for( int i = 0; i < state.size(); i++ ){
+	  if( i > 0 ){
+		 out += ' ';
+	  }
+	  if( state[i] >= 10 ){
+		 out += (char)( '0' + state[i] / 10 );
+	  }
+	  out += (char)( '0' + state[i] % 10 );
+   }
+}
+
+// States per block of generateStates()
+const ull GENERATE_BLOCK = 4096;
+
+// Write count uniformly random cubes to stdout as server requests
+// "<n> <40 values>", n counting from 0. Block b of GENERATE_BLOCK states is
+// drawn from stream b of seed, so the output only depends on seed and
+// count, not on the number of threads. Thread t makes blocks t, t+threads,
+// ... and they are written in order. Returns false if stdout failed.
+bool generateStates(ull count, ull seed, int threads){
+   ull blocks = ( count + GENERATE_BLOCK - 1 ) / GENERATE_BLOCK;
+   ull nextBlock = 0; // next block to be written
+   bool failed = false;
+   mutex lock;
+   condition_variable turn;
+
+   vector<thread> workers;
+   for( int t = 0; t < threads; t++ ){
+	  workers.push_back( thread( [&, t](){
+		 string out;
+		 for( ull b = t; b < blocks; b += threads ){
+			cubeRandom rng(seed, b);
+			out.clear();
+			ull last = min( count, ( b + 1 ) * GENERATE_BLOCK );
+			for( ull n = b * GENERATE_BLOCK; n < last; n++ ){
+			   out += to_string(n);
+			   out += ' ';
+			   appendState(randomState(rng), out);
+			   out += '\n';
+			}
+
+			unique_lock<mutex> guard(lock);
+			while( nextBlock != b ){
+			   turn.wait(guard);
+			}
+			if( !failed && !cout.write(out.data(), out.size()) ){
+			   failed = true;
+			}
+			nextBlock++;
+			turn.notify_all();
+		 }
+	  } ) );
+   }
+   for( int t = 0; t < threads; t++ ){
+	  workers[t].join();
+   }
+   cout.flush();
+   return !failed && cout;
+}
+
+// Apply random moves 0-17 to a state and return the path
+vi scramble(int number_of_moves, vi & state, cubeRandom & rng){
+   int random;
+   vi path;
+
+   for( int i = 0; i < number_of_moves; i++){
+	  random = rng.below(18);
+	  state = applyMove(random, state);
+	  path.push_back(random);
+   }
+   return path;
+}
+
+
+//--- Bulk move sequence execution
+// A cube state is also a transform: location i takes the piece from location
+// perm[i] and adds twist[i] to its orientation (mod 2 for edges, mod 3 for
+// corners). applyMove(m, state) is state followed by the transform of the
+// solved cube after m, so a whole move sequence folds into one transform.
+struct cubeTransform {
+   int perm[20];
+   int twist[20];
+};
+
+cubeTransform toTransform(const vi & state){
+   cubeTransform t;
+   for( int i = 0; i < 20; i++ ){
+	  t.perm[i] = state[i];
+	  t.twist[i] = state[i+20];
+   }
+   return t;
+}
+
+// a followed by b
+cubeTransform compose(const cubeTransform & a, const cubeTransform & b){
+   cubeTransform t;
+   for( int i = 0; i < 20; i++ ){
+	  t.perm[i] = a.perm[ b.perm[i] ];
+	  t.twist[i] = ( a.twist[ b.perm[i] ] + b.twist[i] ) % ( i < 12 ? 2 : 3 );
+   }
+   return t;
+}
+
+// Apply t to count states stored back to back, 40 ints each
+void applyTransform(const cubeTransform & t, int * states, size_t count){
+   int old[40];
+   for( size_t n = 0; n < count; n++ ){
+	  int * state = states + 40*n;
+	  memcpy(old, state, sizeof(old));
+	  for( int i = 0; i < 12; i++ ){
+		 state[i] = old[ t.perm[i] ];
+		 state[i+20] = ( old[ t.perm[i] + 20 ] + t.twist[i] ) & 1;
+	  }
+	  for( int i = 12; i < 20; i++ ){
+		 int twist = old[ t.perm[i] + 20 ] + t.twist[i];
+		 state[i] = old[ t.perm[i] ];
+		 state[i+20] = ( twist >= 3 ) ? twist - 3 : twist;
+	  }
+   }
+}
+
+// Replays move sequences on many cubes at once. Sequences are folded into a
+// single transform, built from cached transforms of SEQUENCE_CHUNK move
+// pieces so sequences sharing pieces share the work. Not thread safe, use
+// one executor per thread.
+const int SEQUENCE_CHUNK = 4;
+
+class sequenceExecutor {
+   public:
+	  sequenceExecutor(){
+		 for( int move = 0; move < 18; move++ ){
+			moveTransform[move] = toTransform( applyMove(move, initialize()) );
+		 }
+	  }
+
+	  // Transform of a whole sequence
+	  const cubeTransform & transform(const vi & moves){
+		 map<vi, cubeTransform>::iterator it = cache.find(moves);
+		 if( it != cache.end() ){
+			return it->second;
+		 }
+		 cubeTransform t = toTransform(initialize());
+		 for( int i = 0; i < moves.size(); i += SEQUENCE_CHUNK ){
+			vi chunk( moves.begin() + i,
+				  moves.begin() + min( (int)moves.size(), i + SEQUENCE_CHUNK ) );
+			t = compose(t, chunkTransform(chunk));
+		 }
+		 return remember(moves, t);
+	  }
+
+	  // Apply a sequence to count states stored back to back, 40 ints each
+	  void apply(const vi & moves, int * states, size_t count){
+		 applyTransform(transform(moves), states, count);
+	  }
+
+	  void apply(const vi & moves, vector<vi> & states){
+		 const cubeTransform & t = transform(moves);
+		 for( int i = 0; i < states.size(); i++ ){
+			applyTransform(t, &states[i][0], 1);
+		 }
+	  }
+
+   private:
+	  static const size_t CACHE_LIMIT = 1 << 16;
+
+	  const cubeTransform & chunkTransform(const vi & chunk){
+		 map<vi, cubeTransform>::iterator it = cache.find(chunk);
+		 if( it != cache.end() ){
+			return it->second;
+		 }
+		 cubeTransform t = moveTransform[ chunk[0] ];
+		 for( int i = 1; i < chunk.size(); i++ ){
+			t = compose(t, moveTransform[ chunk[i] ]);
+		 }
+		 return remember(chunk, t);
+	  }
+
+	  // Start over rather than grow without bound
+	  const cubeTransform & remember(const vi & moves, const cubeTransform & t){
+		 if( cache.size() >= CACHE_LIMIT ){
+			cache.clear();
+		 }
+		 return cache[moves] = t;
+	  }
+
+	  cubeTransform moveTransform[18];
+	  map<vi, cubeTransform> cache;
+};
+
+//--- Result of a complete solve. On failure path holds the moves of the
+//phases that finished before the budget ran out.
+struct solveResult {
+   vi path;
+   int status; // solveStatus
+   int phasesCompleted;
+   long long nodes; // expanded nodes over all phases
+   size_t peakMemory; // largest search memory of any phase, in bytes
+   double cost; // path cost under budget.moveCost, or its length
+   double seconds;
+};
+
+// Beam search over the phases: keep the budget.beamWidth shortest partial
+// solutions after every phase and return the shortest complete one. Phases
+// before firstPhase are taken as already done.
+solveResult solveBeam(vi cube, solveBudget budget, int firstPhase = 1){
+   chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+   vi goalCube = initialize();
+   solveResult result;
+   result.phasesCompleted = firstPhase - 1;
+
+   vector<beamCandidate> beam(1);
+   beam[0].state = cube;
+   for( phase = firstPhase; phase <= 4; phase++ ){
+	  beam = BDBFSMulti( beam, goalCube, budget.beamWidth, &budget );
+	  if( budget.status != SOLVED ){
+		 break;
+	  }
+	  result.phasesCompleted++;
+   }
+
+   if( budget.status == SOLVED && !beam.empty() ){
+	  result.path = beam[0].path;
+   }
+   result.status = budget.status;
+   result.nodes = budget.nodes;
+   result.peakMemory = budget.peakMemory;
+   result.cost = budget.moveCost.empty() ? result.path.size() :
+	  pathCost(result.path, budget.moveCost);
+   result.seconds = chrono::duration<double>(
+		 chrono::steady_clock::now() - begin ).count();
+   return result;
+}
+
+// Run the four phases on a cube within the given budget. Phases before
+// firstPhase are taken as already done.
+solveResult solve(vi cube, solveBudget budget, int firstPhase = 1){
+   if( budget.beamWidth > 1 ){
+	  return solveBeam(cube, budget, firstPhase);
+   }
+
+   chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+   vi goalCube = initialize();
+   solveResult result;
+   result.phasesCompleted = firstPhase - 1;
+
+   for( phase = firstPhase; phase <= 4; phase++ ){
+
+	  // Try to reach G3 from G1 in one search, which can find a shorter
+	  // path than phases 2 and 3 apart. If its own node budget runs out we
+	  // carry on with the two ordinary searches. Phase 1 can overshoot the
+	  // caller's budget between checks, so check it first, and never hand
+	  // the fused search 0 nodes, which would mean unlimited.
+	  if( phase == 2 && budget.fusedBudget > 0 ){
+		 if( budgetExhausted(&budget) ){
+			break;
+		 }
+		 solveBudget fused = budget;
+		 fused.nodes = 0;
+		 fused.nodeBudget = budget.fusedBudget;
+		 if( budget.nodeBudget > 0 ){
+			fused.nodeBudget = max( min( fused.nodeBudget,
+					 budget.nodeBudget - budget.nodes ), 1LL );
+		 }
+		 phase = FUSED_PHASE;
+		 vi path = budget.moveCost.empty() ? BDBFS( cube, goalCube, &fused ) :
+			weightedSearch( cube, goalCube, budget.moveCost, &fused );
+		 phase = 2;
+		 budget.nodes += fused.nodes;
+		 budget.peakMemory = max(budget.peakMemory, fused.peakMemory);
+		 if( fused.status == SOLVED ){
+			result.path.insert(result.path.end(), path.begin(), path.end());
+			result.phasesCompleted += 2;
+			phase = 3;
+			continue;
+		 }
+		 if( fused.status != NODE_BUDGET_EXCEEDED || budgetExhausted(&budget) ){
+			budget.status = ( budget.status != SOLVED ) ? budget.status :
+			   fused.status;
+			break;
+		 }
+	  }
+
+	  vi path = budget.moveCost.empty() ? BDBFS( cube, goalCube, &budget ) :
+		 weightedSearch( cube, goalCube, budget.moveCost, &budget );
+	  if( budget.status != SOLVED ){
+		 break;
+	  }
+	  result.path.insert(result.path.end(), path.begin(), path.end());
+	  result.phasesCompleted++;
+   }
+
+   result.status = budget.status;
+   result.nodes = budget.nodes;
+   result.peakMemory = budget.peakMemory;
+   result.cost = budget.moveCost.empty() ? result.path.size() :
+	  pathCost(result.path, budget.moveCost);
+   result.seconds = chrono::duration<double>(
+		 chrono::steady_clock::now() - begin ).count();
+   return result;
+}
+
+// True if state is 40 values laid out like a cube: edges a permutation of
+// 0-11, corners of 12-19, flips 0-1 and twists 0-2. It may still be
+// unsolvable through its parities.
+bool validCube(const vi & state){
+   if( state.size() != 40 ){
+	  return false;
+   }
+   bool seen[20] = { false };
+   for( int i = 0; i < 20; i++ ){
+	  int first = ( i < 12 ) ? 0 : 12;
+	  int last = ( i < 12 ) ? 11 : 19;
+	  int orientations = ( i < 12 ) ? 2 : 3;
+	  if( state[i] < first || state[i] > last || seen[state[i]] ||
+			state[i+20] < 0 || state[i+20] >= orientations ){
+		 return false;
+	  }
+	  seen[state[i]] = true;
+   }
+   return true;
+}
+
+//--- Solving towards a target pattern
+// Moves act on locations, so renaming the pieces does not change what a
+// move sequence does. Renaming every piece after the location it has in
+// target, with its orientation measured against target's, turns target into
+// the solved cube (this is the cube multiplied by the inverse of target on
+// the left). A solution of the renamed cube then takes the original cube to
+// target, and every phase still searches towards the solved goal. Returns
+// false, leaving relabeled alone, unless both cubes pass validCube().
+bool relabelForTarget(const vi & state, const vi & target, vi & relabeled){
+   if( !validCube(state) || !validCube(target) ){
+	  return false;
+   }
+   int where[20]; // location of each piece in target
+   for( int i = 0; i < 20; i++ ){
+	  where[target[i]] = i;
+   }
+
+   relabeled.assign(40, 0);
+   for( int i = 0; i < 12; i++ ){
+	  int loc = where[state[i]];
+	  relabeled[i] = loc;
+	  relabeled[i+20] = ( state[i+20] - target[loc+20] + 2 ) % 2;
+   }
+   for( int i = 12; i < 20; i++ ){
+	  int loc = where[state[i]];
+	  relabeled[i] = loc;
+	  relabeled[i+20] = ( state[i+20] - target[loc+20] + 3 ) % 3;
+   }
+   return true;
+}
+
+// Find a path taking cube to target instead of to the solved cube. Cubes
+// that are not valid come back UNSOLVABLE without searching.
+solveResult solveToTarget(vi cube, const vi & target, solveBudget budget){
+   vi relabeled;
+   if( !relabelForTarget(cube, target, relabeled) ){
+	  solveResult result;
+	  result.status = UNSOLVABLE;
+	  result.phasesCompleted = 0;
+	  result.nodes = 0;
+	  result.peakMemory = 0;
+	  result.cost = 0;
+	  result.seconds = 0;
+	  return result;
+   }
+   return solve(relabeled, budget);
+}
+
+//--- Re-solving after a slip
+// Cube before each move of a solution that ends in target: planned[j] is
+// the cube after the first j moves, planned[path.size()] is target
+vector<vi> plannedStates(const vi & path, const vi & target){
+   vector<vi> planned(path.size() + 1);
+   planned[path.size()] = target;
+   for( int j = path.size() - 1; j >= 0; j-- ){
+	  planned[j] = applyMove(inverse(path[j]), planned[j+1]);
+   }
+   return planned;
+}
+
+// Nodes allowed for the repair back onto the old plan
+const long long REPAIR_NODE_BUDGET = 20000;
+
+// New moves for a cube that left the plan. previous is the old solution
+// towards target, executed the index of its last move that was carried out
+// (-1 for none) and observed the cube as it is now.
+//  - If observed is anywhere on the old plan, the rest of the plan is
+//    returned without searching.
+//  - Otherwise a short search takes observed back to where the plan expected
+//    it to be (relabelForTarget() against that planned cube, which is only
+//    the slip away from solved) and the rest of the plan follows.
+//  - If that repair does not fit REPAIR_NODE_BUDGET, the phases observed
+//    still satisfies according to id() are skipped and the others are
+//    searched afresh.
+solveResult resolve(const vi & previous, int executed, const vi & observed,
+	  solveBudget budget, const vi & target){
+   chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+   vector<vi> planned = plannedStates(previous, target);
+   solveResult result;
+
+   for( int j = 0; j < planned.size(); j++ ){
+	  if( planned[j] == observed ){
+		 result.path.assign(previous.begin() + j, previous.end());
+		 result.status = SOLVED;
+		 result.phasesCompleted = 4;
+		 result.nodes = 0;
+		 result.peakMemory = 0;
+		 result.cost = budget.moveCost.empty() ? result.path.size() :
+			pathCost(result.path, budget.moveCost);
+		 result.seconds = chrono::duration<double>(
+			   chrono::steady_clock::now() - begin ).count();
+		 return result;
+	  }
+   }
+
+   int expected = min( max( executed + 1, 0 ), (int)previous.size() );
+   // the repair counts its own nodes and may not use more than the caller
+   // has left (at least 1, 0 would mean unlimited)
+   solveBudget repair = budget;
+   repair.nodes = 0;
+   repair.nodeBudget = REPAIR_NODE_BUDGET;
+   if( budget.nodeBudget > 0 ){
+	  repair.nodeBudget = max( min( repair.nodeBudget,
+			   budget.nodeBudget - budget.nodes ), 1LL );
+   }
+   repair.fusedBudget = 0;
+   repair.beamWidth = 1;
+   result = solveToTarget(observed, planned[expected], repair);
+   budget.nodes += result.nodes;
+   budget.peakMemory = max(budget.peakMemory, result.peakMemory);
+   result.nodes = budget.nodes;
+   result.peakMemory = budget.peakMemory;
+   if( result.status == SOLVED ){
+	  result.path.insert(result.path.end(), previous.begin() + expected,
+			previous.end());
+   }
+   else if( result.status == NODE_BUDGET_EXCEEDED && !budgetExhausted(&budget) ){
+	  // Start at the first phase whose subgroup the cube has left
+	  vi cube;
+	  relabelForTarget(observed, target, cube);
+	  vi goalCube = initialize();
+	  int firstPhase = 1;
+	  for( phase = 1; phase <= 4; phase++ ){
+		 if( compactID(cube) != compactID(goalCube) ){
+			break;
+		 }
+		 firstPhase++;
+	  }
+	  result = solve(cube, budget, firstPhase);
+   }
+   result.cost = budget.moveCost.empty() ? result.path.size() :
+	  pathCost(result.path, budget.moveCost);
+   result.seconds = chrono::duration<double>(
+		 chrono::steady_clock::now() - begin ).count();
+   return result;
+}
+
+//--- Fixed set of worker threads pulling tasks from a shared queue. A NUMA
+//aware pool spreads its workers over the nodes round robin and pins each to
+//a cpu, so the tables a solve allocates end up on the worker's own node.
+class threadPool {
+   public:
+	  threadPool(int threads, bool numaAware = false)
+		 : stopping(false), started(chrono::steady_clock::now()) {
+		 vector<vi> nodes = numaTopology();
+		 poolNodes = numaAware ? cpuNodes(nodes) : vi(1, 0);
+		 completed.resize( numaAware ? nodes.size() : 1 );
+		 for( int i = 0; i < threads; i++ ){
+			int node = numaAware ? poolNodes[ i % poolNodes.size() ] : -1;
+			int cpu = numaAware ? nodes[node][ ( i / poolNodes.size() ) %
+			   nodes[node].size() ] : -1;
+			workers.push_back( thread(&threadPool::work, this, cpu, node) );
+		 }
+	  }
+
+	  ~threadPool(){
+		 {
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		 }
+		 wake.notify_all();
+		 for( int i = 0; i < workers.size(); i++ ){
+			workers[i].join();
+		 }
+	  }
+
+	  // Queue a task and return a future for its result
+	  template<class F>
+	  future<typename result_of<F()>::type> submit(F task){
+		 typedef typename result_of<F()>::type R;
+		 shared_ptr< packaged_task<R()> > job =
+			make_shared< packaged_task<R()> >(task);
+		 future<R> result = job->get_future();
+		 {
+			lock_guard<mutex> guard(lock);
+			tasks.push( [job](){ (*job)(); } );
+		 }
+		 wake.notify_one();
+		 return result;
+	  }
+
+	  // Tasks finished per NUMA node and per second since the pool started
+	  string report(){
+		 double seconds = chrono::duration<double>(
+			   chrono::steady_clock::now() - started ).count();
+		 ostringstream out;
+		 lock_guard<mutex> guard(lock);
+		 for( int i = 0; i < poolNodes.size(); i++ ){
+			int node = poolNodes[i];
+			out << " node" << node << " " << completed[node] << " " <<
+			   completed[node] / seconds;
+		 }
+		 return out.str();
+	  }
+
+   private:
+	  void work(int cpu, int node){
+		 if( cpu >= 0 ){
+			pinToCpu(cpu, node);
+		 }
+		 while( true ){
+			function<void()> task;
+			{
+			   unique_lock<mutex> guard(lock);
+			   while( !stopping && tasks.empty() ){
+				  wake.wait(guard);
+			   }
+			   if( tasks.empty() ){
+				  return;
+			   }
+			   task = tasks.front();
+			   tasks.pop();
+			}
+			task();
+			lock_guard<mutex> guard(lock);
+			completed[ node >= 0 ? node : 0 ]++;
+		 }
+	  }
+
+	  vector<thread> workers;
+	  queue< function<void()> > tasks;
+	  mutex lock;
+	  condition_variable wake;
+	  bool stopping;
+	  chrono::steady_clock::time_point started;
+	  vi poolNodes; // ids of the nodes workers run on
+	  vector<long long> completed; // tasks finished per node id
+};
+
+// Solve a cube on the pool. Cancel through budget.cancel, or let the deadline
+// or node budget end the search; the future then holds the partial result.
+future<solveResult> solveAsync(threadPool & pool, vi cube, solveBudget budget){
+   return pool.submit( [cube, budget](){ return solve(cube, budget); } );
+}
+
+
+//--- Solve server
+// Line protocol, one request per line:
+//    <id> <40 state values in the same layout as initialize()>
+// or, to solve towards a pattern other than the solved cube,
+//    <id> <40 state values> <40 target state values>
+// answered, in whatever order the solves finish, with
+//    <id> OK <solution moves>
+//    <id> ERR <reason>
+// Requests may be pipelined; the id is only echoed back. The line
+//    stats
+// is answered with "stats" and, for every NUMA node, the node number, the
+// solves finished there and the solves per second.
+
+// One client connection, closed once the reader and all pending solves are
+// done with it
+struct clientConnection {
+   int fd;
+   mutex writeLock;
+
+   clientConnection(int fd) : fd(fd) {}
+   ~clientConnection(){ close(fd); }
+
+   // Write a whole response line, responses from workers never interleave
+   void send(const string & line){
+	  lock_guard<mutex> guard(writeLock);
+	  size_t done = 0;
+	  while( done < line.size() ){
+		 ssize_t n = write(fd, line.data() + done, line.size() - done);
+		 if( n <= 0 ){
+			return; // client went away
+		 }
+		 done += n;
+	  }
+   }
+};
+
+// Parse "<id> <40 ints> [<40 ints>]", returns false on a malformed request
+// or one whose cubes fail validCube(). target is the solved cube unless one
+// is given.
+bool parseRequest(const string & line, string & requestID, vi & state,
+	  vi & target){
+   istringstream in(line);
+   if( !(in >> requestID) ){
+	  return false;
+   }
+   int value;
+   while( in >> value ){
+	  state.push_back(value);
+   }
+   if( !in.eof() || ( state.size() != 40 && state.size() != 80 ) ){
+	  return false;
+   }
+   if( state.size() == 80 ){
+	  target.assign(state.begin() + 40, state.end());
+	  state.resize(40);
+   }
+   else{
+	  target = initialize();
+   }
+   return validCube(state) && validCube(target);
+}
+
+// Answer every complete line in buffer, leaving any partial line behind.
+// All queued lines go to the pool at once.
+void dispatchRequests(string & buffer, threadPool & pool,
+	  shared_ptr<clientConnection> client){
+   size_t start = 0;
+   size_t end;
+   while( ( end = buffer.find('\n', start) ) != string::npos ){
+	  string line = buffer.substr(start, end - start);
+	  start = end + 1;
+	  if( line.empty() ){
+		 continue;
+	  }
+	  if( line == "stats" ){
+		 client->send( "stats" + pool.report() + "\n" );
+		 continue;
+	  }
+
+	  string requestID;
+	  vi state;
+	  vi target;
+	  if( !parseRequest(line, requestID, state, target) ){
+		 client->send( ( requestID.empty() ? "-" : requestID ) +
+			   " ERR bad request\n" );
+		 continue;
+	  }
+
+	  pool.submit( [client, requestID, state, target](){
+		 solveResult result = solveToTarget(state, target, solveBudget());
+		 vi check = state;
+		 for( int i = 0; i < result.path.size(); i++ ){
+			check = applyMove(result.path[i], check);
+		 }
+		 if( check != target ){
+			client->send( requestID + " ERR unsolvable\n" );
+			return;
+		 }
+		 string build;
+		 build_path(result.path, build);
+		 client->send( requestID + " OK " + build + "\n" );
+	  } );
+   }
+   buffer.erase(0, start);
+}
+
+// Read requests from a client until it hangs up
+void serveClient(int fd, threadPool * pool){
+   shared_ptr<clientConnection> client = make_shared<clientConnection>(fd);
+   string buffer;
+   char chunk[4096];
+   ssize_t n;
+   while( ( n = read(fd, chunk, sizeof(chunk)) ) > 0 ){
+	  buffer.append(chunk, n);
+	  dispatchRequests(buffer, *pool, client);
+   }
+}
+
+// Listen on localhost if address is a port number, on an IPv4 address given
+// as host:port, and on a Unix socket path otherwise. A path cannot contain
+// ':', so a malformed host:port is refused rather than made into a file.
+int serve(const string & address, int threads, bool numaAware){
+   signal(SIGPIPE, SIG_IGN);
+
+   int listener;
+   size_t colon = address.rfind(':');
+   string host = ( colon == string::npos ) ? "" : address.substr(0, colon);
+   string port = ( colon == string::npos ) ? address :
+	  address.substr(colon + 1);
+   bool tcp = !port.empty() &&
+	  port.find_first_not_of("0123456789") == string::npos;
+   if( colon != string::npos && !tcp ){
+	  cerr << "bad address " << address << ", expected <port> or <IPv4 address>:<port>" << endl;
+	  return 1;
+   }
+   if( tcp ){
+	  sockaddr_in addr;
+	  memset(&addr, 0, sizeof(addr));
+	  addr.sin_family = AF_INET;
+	  addr.sin_port = htons(atoi(port.c_str()));
+	  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	  if( !host.empty() &&
+			inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ){
+		 cerr << "bad address " << address << ", expected <port> or <IPv4 address>:<port>" << endl;
+		 return 1;
+	  }
+	  listener = socket(AF_INET, SOCK_STREAM, 0);
+	  if( listener < 0 ){
+		 perror("socket");
+		 return 1;
+	  }
+	  int on = 1;
+	  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	  if( bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 ){
+		 perror("bind");
+		 return 1;
+	  }
+   }
+   else{
+	  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	  if( listener < 0 ){
+		 perror("socket");
+		 return 1;
+	  }
+	  sockaddr_un addr;
+	  memset(&addr, 0, sizeof(addr));
+	  addr.sun_family = AF_UNIX;
+	  strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+	  unlink(address.c_str());
+	  if( bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 ){
+		 perror("bind");
+		 return 1;
+	  }
+   }
+   if( listen(listener, 64) < 0 ){
+	  perror("listen");
+	  return 1;
+   }
+
+   threadPool pool(threads, numaAware);
+   while( true ){
+	  int fd = accept(listener, NULL, NULL);
+	  if( fd < 0 ){
+		 continue;
+	  }
+	  thread(serveClient, fd, &pool).detach();
+   }
+}
+
+
+// Solve a uniformly random cube, printing the cube (40 values, as the server
+// takes them) and the solution
+// Run as a solve server instead with:
+//    thistlethwaite --serve <socket path | port | host:port> [threads] [--numa]
+// write the solution as a binary path record with:
+//    thistlethwaite --binary
+// or write n random cubes as server requests, for load testing, with:
+//    thistlethwaite --generate <n> [--threads <t>]
+// A fixed seed for the cube can be given with --seed <n>, and
+// --fuse <nodes> tries phases 2 and 3 as one search of up to that many nodes,
+// --beam <k> keeps the k shortest partial solutions after every phase and
+// --memory <MB> caps how far a phase's search table may grow. With
+// --costs <c0,c1,...,c17> (seconds per move, in move number order) the
+// solution of least total time is searched for instead of the shortest.
+int main(int argc, char** argv){
+
+   if( argc > 2 && string(argv[1]) == "--serve" ){
+	  int threads = ( argc > 3 && string(argv[3]).compare(0, 2, "--") != 0 ) ?
+		 atoi(argv[3]) : thread::hardware_concurrency();
+	  bool numaAware = ( string(argv[argc-1]) == "--numa" );
+	  return serve(argv[2], threads > 0 ? threads : 1, numaAware);
+   }
+
+   bool binary = false;
+   ull generate = 0;
+   int threads = thread::hardware_concurrency();
+   solveBudget budget;
+   ull seed = time(NULL);
+   for( int i = 1; i < argc; i++ ){
+	  if( string(argv[i]) == "--binary" ){
+		 binary = true;
+	  }
+	  if( string(argv[i]) == "--generate" && i+1 < argc ){
+		 generate = strtoull(argv[++i], NULL, 10);
+	  }
+	  if( string(argv[i]) == "--threads" && i+1 < argc ){
+		 threads = atoi(argv[++i]);
+	  }
+	  if( string(argv[i]) == "--seed" && i+1 < argc ){
+		 seed = strtoull(argv[++i], NULL, 10);
+	  }
+	  if( string(argv[i]) == "--fuse" && i+1 < argc ){
+		 budget.fusedBudget = atoll(argv[++i]);
+	  }
+	  if( string(argv[i]) == "--beam" && i+1 < argc ){
+		 budget.beamWidth = atoi(argv[++i]);
+	  }
+	  if( string(argv[i]) == "--memory" && i+1 < argc ){
+		 budget.memoryLimit = strtoull(argv[++i], NULL, 10) << 20;
+	  }
+	  if( string(argv[i]) == "--costs" && i+1 < argc ){
+		 istringstream costs(argv[++i]);
+		 string cost;
+		 while( getline(costs, cost, ',') ){
+			char * end;
+			double value = strtod(cost.c_str(), &end);
+			if( cost.empty() || *end != '\0' ||
+				  !( value > 0 && value <= numeric_limits<double>::max() ) ){
+			   cerr << "--costs values must be positive numbers" << endl;
+			   return 1;
+			}
+			budget.moveCost.push_back(value);
+		 }
+		 if( budget.moveCost.size() != 18 ){
+			cerr << "--costs needs 18 values" << endl;
+			return 1;
+		 }
+	  }
+   }
+   if( generate > 0 ){
+	  if( !generateStates(generate, seed, threads > 0 ? threads : 1) ){
+		 cerr << "write failed" << endl;
+		 return 1;
+	  }
+	  return 0;
+   }
+   cubeRandom rng(seed);
+   pathWriter binaryOut(1);
+
+   int averageMovesPerformed = 0;
+   int averagePathLength = 0;
+   // initialize a cube in its solved state
+   for( int i = 0; i < 1; i++ ){
+
+	  totalMoves = 0;
+
+	  // a uniformly random cube, 30 random moves are not
+	  vi cube = randomState(rng);
+	  string sp;
+	  appendState(cube, sp);
+
+	  // begin solving cube by iteratively going through the 4 phases
+	  solveResult result = solve(cube, budget);
+	  vi solution = result.path; // complete solution moves
+	  string build; // complete solution string
+	  build_path(solution, build);
+	  averagePathLength += solution.size();
+
+	  // Print scramble path, solution
+	  if( binary ){
+		 if( !binaryOut.write(solution) || !binaryOut.flush() ){
+			perror("write");
+			return 1;
+		 }
+	  }
+	  else{
+		 cout << sp << endl;
+		 cout << build << endl;
+	  }
 	  averageMovesPerformed += totalMoves;
    }
 